@@ -0,0 +1,97 @@
+#include "../liblumix.h"
+
+#include <charconv>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+
+// decodes every RW2/JPG file in a directory with an increasing number of workers and prints the best throughput of a few runs
+// usage: decode_benchmark <directory> [max workers, up to 4x the number of cores]
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <directory> [max workers]" << std::endl;
+        return 1;
+    }
+
+    // hardware_concurrency can return 0 if it is unknown
+    unsigned int cores = std::max(std::thread::hardware_concurrency(), 1u);
+    // more workers than this can't show any more scaling, and keeps the doubling below from overflowing
+    unsigned int workerLimit = cores * 4;
+
+    unsigned int maxWorkers = cores;
+    if (argc > 2) {
+        // only accept a whole positive number (a negative value would wrap around to billions of workers)
+        std::string_view arg = argv[2];
+        std::from_chars_result result = std::from_chars(arg.data(), arg.data() + arg.size(), maxWorkers);
+        if (result.ec != std::errc() || result.ptr != arg.data() + arg.size() || maxWorkers == 0 || maxWorkers > workerLimit) {
+            std::cout << "Usage: " << argv[0] << " <directory> [max workers (1-" << workerLimit << ")]" << std::endl;
+            return 1;
+        }
+    }
+
+    // load all of the sample files into memory so only decoding is measured
+    std::vector<Lumix::ImageData> samples;
+    for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(argv[1])) {
+        std::string filename = entry.path().filename().string();
+
+        // the decoder picks the format from the (uppercase) file extension, same as files from the camera
+        if (filename.find(".RW2") == std::string::npos && filename.find(".JPG") == std::string::npos) {
+            continue;
+        }
+
+        std::ifstream file(entry.path(), std::ios::binary);
+        Lumix::ImageData imageData{};
+        imageData.filename = filename;
+        imageData.rawFileData = std::vector<unsigned char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        samples.push_back(std::move(imageData));
+    }
+
+    if (samples.empty()) {
+        std::cout << "No RW2 or JPG files found in " << argv[1] << std::endl;
+        return 1;
+    }
+
+    std::cout << "Decoding " << samples.size() << " files" << std::endl;
+
+    // powers of two up to the max worker count, plus the max itself
+    std::vector<unsigned int> workerCounts;
+    for (unsigned int workerCount = 1; workerCount < maxWorkers; workerCount *= 2) {
+        workerCounts.push_back(workerCount);
+    }
+    workerCounts.push_back(maxWorkers);
+
+    // each worker count gets a discarded warm-up batch, then the best of a few timed runs is reported
+    const int timedRuns = 3;
+
+    double baseline = 0;
+    for (unsigned int workerCount : workerCounts) {
+        Lumix::DecodeService service(workerCount);
+
+        std::vector<Lumix::ImageData> images = samples;
+        std::vector<bool> results = service.DecodeBatch(images);
+
+        std::chrono::duration<double> elapsed = std::chrono::duration<double>::max();
+        for (int run = 0; run < timedRuns; run++) {
+            images = samples;
+
+            auto start = std::chrono::steady_clock::now();
+            results = service.DecodeBatch(images);
+            elapsed = std::min<std::chrono::duration<double>>(elapsed, std::chrono::steady_clock::now() - start);
+        }
+
+        size_t failed = std::count(results.begin(), results.end(), false);
+        double throughput = images.size() / elapsed.count();
+        if (baseline == 0) {
+            baseline = throughput;
+        }
+
+        std::cout << workerCount << " workers: " << elapsed.count() << " s, " << throughput << " frames/s, "
+                  << throughput / baseline << "x";
+        if (failed > 0) {
+            std::cout << " (" << failed << " failed)";
+        }
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
@@ -5,6 +5,146 @@ using namespace Lumix;
 using namespace pugi;
 using namespace cppcodec;
 
+// libjpeg error manager that jumps back into DecodeJPG instead of calling exit() on a corrupt image
+struct JpegErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmpBuffer;
+};
+
+static void JpegErrorExit(j_common_ptr cinfo) {
+    // print the error, then return to the setjmp in DecodeJPG
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(reinterpret_cast<JpegErrorManager*>(cinfo->err)->setjmpBuffer, 1);
+}
+
+static void SetupJpegErrorManager(jpeg_decompress_struct& cinfo, JpegErrorManager& jerr) {
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = JpegErrorExit;
+}
+
+// decode helpers shared by Camera and DecodeService, these leave the decoder state ready to be reused for the next image
+// cinfo.err must point to a JpegErrorManager (see SetupJpegErrorManager)
+static bool DecodeJPG(jpeg_decompress_struct& cinfo, ImageData& imageData) {
+    JpegErrorManager* jerr = reinterpret_cast<JpegErrorManager*>(cinfo.err);
+    if (setjmp(jerr->setjmpBuffer)) {
+        // libjpeg hit an error, reset cinfo so it can be used for the next image
+        jpeg_abort_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_mem_src(&cinfo, imageData.rawFileData.data(), imageData.rawFileData.size());
+
+    jpeg_read_header(&cinfo, TRUE);
+
+    // only grayscale and RGB output is supported (YCbCr is converted to RGB), reject CMYK and other color spaces
+    switch (cinfo.jpeg_color_space) {
+    case JCS_GRAYSCALE:
+        cinfo.out_color_space = JCS_GRAYSCALE;
+        break;
+    case JCS_YCbCr:
+    case JCS_RGB:
+        cinfo.out_color_space = JCS_RGB;
+        break;
+    default:
+        std::cout << "Unsupported JPEG color space" << std::endl;
+        jpeg_abort_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_start_decompress(&cinfo);
+
+    imageData.width = cinfo.output_width;
+    imageData.height = cinfo.output_height;
+    imageData.channels = cinfo.output_components;
+    imageData.bit_depth = cinfo.data_precision;
+
+    // size of a row
+    int row_stride = imageData.width * imageData.channels * imageData.bit_depth / 8;
+
+    // save the pixel data
+    imageData.pixelBuffer.resize(row_stride * imageData.height);
+
+    // read straight into the pixel buffer instead of copying through a temporary row
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = imageData.pixelBuffer.data() + cinfo.output_scanline * row_stride;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+
+    // swap the red and blue channels (grayscale images only have one channel)
+    for (size_t i = 0; imageData.channels == 3 && i + 2 < imageData.pixelBuffer.size(); i += 3) {
+        unsigned char temp = imageData.pixelBuffer[i];
+        imageData.pixelBuffer[i] = imageData.pixelBuffer[i + 2];
+        imageData.pixelBuffer[i + 2] = temp;
+    }
+
+    return true;
+}
+
+static bool DecodeRW2(libraw_data_t* processor, ImageData& imageData) {
+    int ret = libraw_open_buffer(processor, imageData.rawFileData.data(), imageData.rawFileData.size());
+    if (ret != LIBRAW_SUCCESS) {
+        libraw_recycle(processor);
+        return false;
+    }
+
+    ret = libraw_unpack(processor);
+    if (ret != LIBRAW_SUCCESS) {
+        libraw_recycle(processor);
+        return false;
+    }
+
+    imageData.width = processor->sizes.width;
+    imageData.height = processor->sizes.height;
+    imageData.channels = processor->idata.colors;
+    imageData.bit_depth = processor->params.output_bps;
+
+    ret = libraw_dcraw_process(processor);
+    if (ret != LIBRAW_SUCCESS) {
+        libraw_recycle(processor);
+        return false;
+    }
+
+    libraw_processed_image_t *image = libraw_dcraw_make_mem_image(processor, &ret);
+    if (image == NULL) {
+        libraw_recycle(processor);
+        return false;
+    }
+
+    // save the pixel data (the resize can throw, so free the LibRaw image first if it does)
+    try {
+        imageData.pixelBuffer.resize(image->data_size);
+    } catch (...) {
+        libraw_dcraw_clear_mem(image);
+        libraw_recycle(processor);
+        throw;
+    }
+    std::memcpy(imageData.pixelBuffer.data(), image->data, image->data_size);
+
+    libraw_dcraw_clear_mem(image);
+
+    // free the image data but keep the processor around for the next image
+    libraw_recycle(processor);
+
+    return true;
+}
+
+// picks the decoder from the file extension, shared by Camera and DecodeService so they accept the same files
+// decodeRW2/decodeJPG decode using whichever decoder state the caller owns
+template <typename DecodeRW2Func, typename DecodeJPGFunc>
+static bool DecodeImage(ImageData& imageData, DecodeRW2Func decodeRW2, DecodeJPGFunc decodeJPG) {
+    if (imageData.filename.find(".RW2") != std::string::npos) {
+        return decodeRW2(imageData);
+    } else if (imageData.filename.find(".JPG") != std::string::npos) {
+        return decodeJPG(imageData);
+    }
+
+    std::cout << "Unsupported file type" << std::endl;
+
+    return false;
+}
+
 Camera::Camera(std::string cameraIp, std::string nameForConnection) {
     cameraData.cameraIp = cameraIp;
 
@@ -430,111 +570,220 @@ bool Camera::DownloadLatestPhoto(ImageData& imageData) {
 }
 
 bool Camera::GetRawPixelData(ImageData& imageData) {
-    // if the file is a RW2, get the pixel data
-    if (imageData.filename.find(".RW2") != std::string::npos) {
-        if (!GetPixelDataFromRW2(imageData)) {
-            return false;
-        }
-        return true;
-    } else if (imageData.filename.find(".JPG") != std::string::npos) {
-        if (!GetPixelDataFromJPG(imageData)) {
-            return false;
-        }
-        return true;
-    }
-
-    std::cout << "Unsupported file type" << std::endl;
-
-    return false;
+    // the decoders are created per call, only for the type of file being decoded
+    return DecodeImage(imageData,
+        [this](ImageData& image) { return GetPixelDataFromRW2(image); },
+        [this](ImageData& image) { return GetPixelDataFromJPG(image); });
 }
 
 bool Camera::GetPixelDataFromJPG(ImageData& imageData) {
     // read using libjpeg
     struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    JpegErrorManager jerr;
 
-    cinfo.err = jpeg_std_error(&jerr);
+    SetupJpegErrorManager(cinfo, jerr);
+    if (setjmp(jerr.setjmpBuffer)) {
+        // jpeg_create_decompress failed
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
     jpeg_create_decompress(&cinfo);
 
-    jpeg_mem_src(&cinfo, imageData.rawFileData.data(), imageData.rawFileData.size());
+    bool success = DecodeJPG(cinfo, imageData);
 
-    jpeg_read_header(&cinfo, TRUE);
-    jpeg_start_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
 
-    imageData.width = cinfo.output_width;
-    imageData.height = cinfo.output_height;
-    imageData.channels = cinfo.output_components;
-    imageData.bit_depth = cinfo.data_precision;
+    return success;
+}
 
-    // size of a row
-    int row_stride = imageData.width * imageData.channels * imageData.bit_depth / 8;
+bool Camera::GetPixelDataFromRW2(ImageData& imageData) {
+    // read using LibRaw
+    libraw_data_t *processor = libraw_init(0);
+    if (processor == NULL) {
+        return false;
+    }
 
-    // save the pixel data
-    imageData.pixelBuffer.resize(row_stride * imageData.height);
+    bool success = DecodeRW2(processor, imageData);
 
-    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, row_stride, 1);
+    libraw_close(processor);
+
+    return success;
+}
+
+struct DecodeService::Worker {
+    std::unique_ptr<std::thread> thread;
+
+    // decoder state is created once and reused for every image this worker decodes
+    libraw_data_t *processor = NULL;
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
 
-    for (int i = 0; i < imageData.height; i++) {
-        jpeg_read_scanlines(&cinfo, buffer, 1);
-        std::memcpy(imageData.pixelBuffer.data() + i * row_stride, buffer[0], row_stride);
+    Worker() {
+        processor = libraw_init(0);
+        if (processor == NULL) {
+            throw std::runtime_error("Failed to initialize LibRaw");
+        }
+
+        SetupJpegErrorManager(cinfo, jerr);
+        if (setjmp(jerr.setjmpBuffer)) {
+            // jpeg_create_decompress failed, the destructor won't run so clean up here
+            jpeg_destroy_decompress(&cinfo);
+            libraw_close(processor);
+            throw std::runtime_error("Failed to initialize libjpeg");
+        }
+        jpeg_create_decompress(&cinfo);
     }
 
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
+    ~Worker() {
+        jpeg_destroy_decompress(&cinfo);
+        libraw_close(processor);
+    }
+};
 
-    // swap the red and blue channels
-    for (int i = 0; i < imageData.pixelBuffer.size(); i += 3) {
-        unsigned char temp = imageData.pixelBuffer[i];
-        imageData.pixelBuffer[i] = imageData.pixelBuffer[i + 2];
-        imageData.pixelBuffer[i + 2] = temp;
+struct DecodeService::Batch {
+    std::function<void(size_t, ImageData&, bool)> onDecoded;
+    size_t remaining;
+    std::exception_ptr callbackException; // first exception thrown by onDecoded, rethrown by DecodeBatch
+    std::mutex mutex;
+    std::condition_variable condition;
+};
+
+DecodeService::DecodeService(unsigned int workerCount) {
+    // hardware_concurrency can return 0 if it is unknown
+    if (workerCount == 0) {
+        workerCount = 1;
     }
 
-    return true;
-}
+    // create every worker before starting any threads, so a failure here has nothing to stop
+    for (unsigned int i = 0; i < workerCount; i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
 
-bool Camera::GetPixelDataFromRW2(ImageData& imageData) {
-    // read using LibRaw
-    libraw_data_t *processor = libraw_init(0);
-    if (processor == NULL) {
-        return false;
+    // start the worker threads
+    workerThreadsRunning = true;
+    try {
+        for (std::unique_ptr<Worker>& worker : workers) {
+            worker->thread = std::make_unique<std::thread>(&DecodeService::WorkerThread, this, std::ref(*worker));
+        }
+    } catch (...) {
+        // join the threads that did start before the workers they use are destroyed
+        StopWorkerThreads();
+        throw;
     }
+}
 
-    int ret = libraw_open_buffer(processor, imageData.rawFileData.data(), imageData.rawFileData.size());
-    if (ret != LIBRAW_SUCCESS) {
-        libraw_close(processor);
-        return false;
+DecodeService::~DecodeService() {
+    // jobs still in the queue are finished first, new batches are not supported from here on
+    StopWorkerThreads();
+}
+
+void DecodeService::StopWorkerThreads() {
+    {
+        std::lock_guard<std::mutex> lock(jobQueueMutex);
+        workerThreadsRunning = false;
     }
+    jobQueueCondition.notify_all();
+    for (std::unique_ptr<Worker>& worker : workers) {
+        // the thread may not exist if starting the threads failed part way through
+        if (worker->thread && worker->thread->joinable()) {
+            worker->thread->join();
+        }
+    }
+}
 
-    ret = libraw_unpack(processor);
-    if (ret != LIBRAW_SUCCESS) {
-        libraw_close(processor);
-        return false;
+unsigned int DecodeService::GetWorkerCount() const {
+    return workers.size();
+}
+
+std::vector<bool> DecodeService::DecodeBatch(std::vector<ImageData>& images) {
+    // workers write to separate elements at the same time, which std::vector<bool> does not allow
+    std::vector<char> results(images.size(), false);
+
+    DecodeBatch(images, [&results](size_t index, ImageData& imageData, bool success) {
+        results[index] = success;
+    });
+
+    return std::vector<bool>(results.begin(), results.end());
+}
+
+void DecodeService::DecodeBatch(std::vector<ImageData>& images, std::function<void(size_t index, ImageData& imageData, bool success)> onDecoded) {
+    if (images.empty()) {
+        return;
     }
 
-    imageData.width = processor->sizes.width;
-    imageData.height = processor->sizes.height;
-    imageData.channels = processor->idata.colors;
-    imageData.bit_depth = processor->params.output_bps;
+    Batch batch;
+    batch.onDecoded = onDecoded;
+    batch.remaining = images.size();
 
-    ret = libraw_dcraw_process(processor);
-    if (ret != LIBRAW_SUCCESS) {
-        libraw_close(processor);
-        return false;
+    // build the jobs first so an allocation failure can't leave workers holding a pointer to this batch
+    std::list<Job> batchJobs;
+    for (size_t i = 0; i < images.size(); i++) {
+        batchJobs.push_back(Job{&batch, i, &images[i]});
     }
 
-    libraw_processed_image_t *image = libraw_dcraw_make_mem_image(processor, &ret);
-    if (image == NULL) {
-        libraw_close(processor);
-        return false;
+    // queue every image (splice doesn't throw)
+    {
+        std::lock_guard<std::mutex> lock(jobQueueMutex);
+        jobQueue.splice(jobQueue.end(), batchJobs);
     }
+    jobQueueCondition.notify_all();
 
-    // save the pixel data
-    imageData.pixelBuffer.resize(image->data_size);
-    std::memcpy(imageData.pixelBuffer.data(), image->data, image->data_size);
+    // wait until every image in the batch has been decoded
+    std::unique_lock<std::mutex> lock(batch.mutex);
+    batch.condition.wait(lock, [&batch] { return batch.remaining == 0; });
 
-    libraw_dcraw_clear_mem(image);
+    if (batch.callbackException) {
+        std::rethrow_exception(batch.callbackException);
+    }
+}
 
-    libraw_close(processor);
+void DecodeService::WorkerThread(Worker& worker) {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(jobQueueMutex);
+            jobQueueCondition.wait(lock, [this] { return !jobQueue.empty() || !workerThreadsRunning; });
+
+            if (jobQueue.empty()) {
+                // only empty here if the service is stopping
+                return;
+            }
 
-    return true;
-}
\ No newline at end of file
+            job = jobQueue.front();
+            jobQueue.pop_front();
+        }
+
+        ImageData& imageData = *job.imageData;
+        bool success = false;
+
+        // an exception here (e.g. std::bad_alloc from bad image dimensions) only fails this image
+        try {
+            success = DecodeImage(imageData,
+                [&worker](ImageData& image) { return DecodeRW2(worker.processor, image); },
+                [&worker](ImageData& image) { return DecodeJPG(worker.cinfo, image); });
+        } catch (...) {
+            // reset the decoders so they can be used for the next image
+            libraw_recycle(worker.processor);
+            jpeg_abort_decompress(&worker.cinfo);
+            success = false;
+        }
+
+        std::exception_ptr callbackException;
+        if (job.batch->onDecoded) {
+            try {
+                job.batch->onDecoded(job.index, imageData, success);
+            } catch (...) {
+                callbackException = std::current_exception();
+            }
+        }
+
+        // notify while holding the lock so the batch can't be destroyed before we are done with it
+        std::lock_guard<std::mutex> lock(job.batch->mutex);
+        if (callbackException && !job.batch->callbackException) {
+            job.batch->callbackException = callbackException;
+        }
+        if (--job.batch->remaining == 0) {
+            job.batch->condition.notify_all();
+        }
+    }
+}
@@ -10,6 +10,11 @@
 #include <thread>
 #include <atomic>
 #include <condition_variable>
+#include <mutex>
+#include <memory>
+#include <list>
+#include <functional>
+#include <exception>
 
 #include <pugixml.hpp>
 
@@ -17,6 +22,7 @@
 #if defined LIBLUMIX_BUILD || defined __INTELLISENSE__
 #include <cpr/cpr.h>
 #include "build/_deps/cppcodec-src/cppcodec/hex_lower.hpp"
+#include <csetjmp>
 #include <jpeglib.h>
 #include <libraw/libraw.h>
 #endif
@@ -132,4 +138,45 @@ namespace Lumix {
         // thread functions
         void GetStateThread();
     };
+
+    // decodes batches of downloaded images on a pool of worker threads (does not need a camera connection)
+    class DecodeService {
+    public:
+        explicit DecodeService(unsigned int workerCount = std::thread::hardware_concurrency());
+        // finishes jobs that are already queued, but DecodeBatch must not be called (from any thread) while the service is being destroyed
+        ~DecodeService();
+
+        // decodes every image and waits for the batch to finish, returns the result of each image in the same order
+        std::vector<bool> DecodeBatch(std::vector<ImageData>& images);
+        // decodes every image and calls onDecoded (from a worker thread) as each one completes, returns once the batch is finished
+        // onDecoded must not throw (if it does, the rest of the batch still finishes and the first exception is rethrown here)
+        // and must not call DecodeBatch, since a call from a worker thread can deadlock the pool
+        void DecodeBatch(std::vector<ImageData>& images, std::function<void(size_t index, ImageData& imageData, bool success)> onDecoded);
+
+        unsigned int GetWorkerCount() const;
+
+    private:
+        // each worker keeps its own LibRaw and libjpeg state (defined in liblumix.cpp)
+        struct Worker;
+        struct Batch;
+
+        struct Job {
+            Batch* batch;
+            size_t index;
+            ImageData* imageData;
+        };
+
+        std::vector<std::unique_ptr<Worker>> workers;
+
+        // separate thread variables
+        std::atomic<bool> workerThreadsRunning = false;
+        std::condition_variable jobQueueCondition;
+        std::mutex jobQueueMutex;
+        std::list<Job> jobQueue; // a list so a whole batch can be spliced in without throwing
+
+        void StopWorkerThreads();
+
+        // thread functions
+        void WorkerThread(Worker& worker);
+    };
 }
\ No newline at end of file